@@ -1,4 +1,5 @@
 #include <janet.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <leveldb/c.h>
@@ -9,6 +10,20 @@
 #define FLAG_DESTROYED 1
 #define FLAG_RELEASED 1
 #define null_err char *err = NULL
+#define INDEX_RANGE 0
+#define INDEX_FIELD 1
+#define INDEX_OFFSET 2
+#define INDEX_MARKER 0xff
+
+typedef struct {
+    uint8_t *prefix;
+    size_t prefixlen;
+    int kind;
+    size_t start;
+    size_t end;
+    size_t field;
+    uint8_t delim;
+} Index;
 
 typedef struct {
     const char *name;
@@ -16,6 +31,8 @@ typedef struct {
     leveldb_options_t* options;
     leveldb_readoptions_t* readoptions;
     leveldb_writeoptions_t* writeoptions;
+    Index *indexes;
+    int32_t indexcount;
     int flags;
 } Db;
 
@@ -42,6 +59,11 @@ static void closedb(Db *db) {
         leveldb_readoptions_destroy(db->readoptions);
         leveldb_writeoptions_destroy(db->writeoptions);
         leveldb_close(db->handle);
+        for (int32_t i = 0; i < db->indexcount; i++)
+            free(db->indexes[i].prefix);
+        free(db->indexes);
+        db->indexes = NULL;
+        db->indexcount = 0;
     }
 }
 
@@ -203,6 +225,8 @@ static Db* initdb(const char *name, leveldb_t *conn, leveldb_options_t *options)
     db->options = options;
     db->readoptions = leveldb_readoptions_create();
     db->writeoptions = leveldb_writeoptions_create();
+    db->indexes = NULL;
+    db->indexcount = 0;
     db->flags = FLAG_OPENED;
     return db;
 }
@@ -267,6 +291,126 @@ static void paniconclosed(int flags) {
     if (flags & FLAG_CLOSED) janet_panic("LevelDB is already closed");
 }
 
+static void paniconbatcherr(char *err, leveldb_writebatch_t *wb) {
+    if (err != NULL) leveldb_writebatch_destroy(wb);
+    paniconerr(err);
+}
+
+/* Escapes \0 as \0\xff and terminates with \0\x01, so encoded parts keep
+ * their byte order and cannot run into the bytes that follow them. */
+static void pushencoded(JanetBuffer *b, const uint8_t *bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        janet_buffer_push_u8(b, bytes[i]);
+        if (bytes[i] == 0) janet_buffer_push_u8(b, 0xff);
+    }
+    janet_buffer_push_u8(b, 0);
+    janet_buffer_push_u8(b, 1);
+}
+
+/* Index entries live under the marker byte, after all record keys. */
+static void pushindexprefix(JanetBuffer *b, const uint8_t *name) {
+    janet_buffer_push_u8(b, INDEX_MARKER);
+    pushencoded(b, name, janet_string_length(name));
+}
+
+static int isindexentry(const char *key, size_t keylen) {
+    return keylen > 0 && (uint8_t) key[0] == INDEX_MARKER;
+}
+
+static size_t encodedend(const uint8_t *bytes, size_t len, size_t from) {
+    size_t i = from;
+    while (i + 1 < len) {
+        if (bytes[i] == 0) {
+            if (bytes[i + 1] == 1) return i + 2;
+            i += 2;
+        } else {
+            i++;
+        }
+    }
+    return len;
+}
+
+static int extract(Index *index, const char *val, size_t vallen, size_t *start, size_t *len) {
+    switch (index->kind) {
+    case INDEX_RANGE:
+        if (vallen < index->end) return 0;
+        *start = index->start;
+        *len = index->end - index->start;
+        return 1;
+    case INDEX_OFFSET:
+        if (vallen < index->start) return 0;
+        *start = index->start;
+        *len = vallen - index->start;
+        return 1;
+    case INDEX_FIELD: {
+        size_t field = 0;
+        size_t from = 0;
+        for (size_t i = 0; i <= vallen; i++) {
+            if (i == vallen || (uint8_t) val[i] == index->delim) {
+                if (field == index->field) {
+                    *start = from;
+                    *len = i - from;
+                    return 1;
+                }
+                field++;
+                from = i + 1;
+            }
+        }
+        return 0;
+    }
+    default:
+        return 0;
+    }
+}
+
+static int indexkey(JanetBuffer *b, Index *index, const char *key, size_t keylen, const char *val, size_t vallen) {
+    size_t start, len;
+    b->count = 0;
+    if (val == NULL || !extract(index, val, vallen, &start, &len)) return 0;
+    janet_buffer_push_bytes(b, index->prefix, index->prefixlen);
+    pushencoded(b, (const uint8_t *) val + start, len);
+    janet_buffer_push_bytes(b, (const uint8_t *) key, keylen);
+    return 1;
+}
+
+static void batchindexes(Db *db, leveldb_writebatch_t *wb, const char *key, size_t keylen,
+                         const char *oldval, size_t oldlen, const char *newval, size_t newlen) {
+    if (isindexentry(key, keylen)) return;
+    JanetBuffer *oldkey = janet_buffer(64);
+    JanetBuffer *newkey = janet_buffer(64);
+    for (int32_t i = 0; i < db->indexcount; i++) {
+        Index *index = &db->indexes[i];
+        int hasold = indexkey(oldkey, index, key, keylen, oldval, oldlen);
+        int hasnew = indexkey(newkey, index, key, keylen, newval, newlen);
+        if (hasold && hasnew && oldkey->count == newkey->count &&
+                memcmp(oldkey->data, newkey->data, oldkey->count) == 0)
+            continue;
+        if (hasold) leveldb_writebatch_delete(wb, (const char *) oldkey->data, oldkey->count);
+        if (hasnew) leveldb_writebatch_put(wb, (const char *) newkey->data, newkey->count, "", 0);
+    }
+}
+
+static void writeindexed(Db *db, const char *key, size_t keylen, const char *val, size_t vallen) {
+    size_t oldlen;
+    null_err;
+
+    char *old = leveldb_get(db->handle, db->readoptions, key, keylen, &oldlen, &err);
+    paniconerr(err);
+
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+    batchindexes(db, wb, key, keylen, old, oldlen, val, vallen);
+    leveldb_free(old);
+    if (val == NULL) {
+        leveldb_writebatch_delete(wb, key, keylen);
+    } else {
+        leveldb_writebatch_put(wb, key, keylen, val, vallen);
+    }
+
+    leveldb_write(db->handle, db->writeoptions, wb, &err);
+    leveldb_writebatch_destroy(wb);
+    paniconerr(err);
+}
+
 static Janet cfun_record_put(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 3);
     Db *db = janet_getabstract(argv, 0, &AT_db);
@@ -277,6 +421,11 @@ static Janet cfun_record_put(int32_t argc, Janet *argv) {
     size_t vallen = janet_string_length(val);
     null_err;
 
+    if (db->indexcount > 0) {
+        writeindexed(db, (const char *) key, keylen, (const char *) val, vallen);
+        return janet_wrap_nil();
+    }
+
     leveldb_put(db->handle, db->writeoptions, (const char *) key, keylen, (const char *) val, vallen, &err);
     paniconerr(err);
 
@@ -313,6 +462,11 @@ static Janet cfun_record_delete(int32_t argc, Janet *argv) {
     size_t keylen = janet_string_length(key);
     null_err;
 
+    if (db->indexcount > 0) {
+        writeindexed(db, (const char *) key, keylen, NULL, 0);
+        return janet_wrap_nil();
+    }
+
     leveldb_delete(db->handle, db->writeoptions, (const char *) key, keylen, &err);
     paniconerr(err);
 
@@ -363,12 +517,74 @@ static void paniconbdestroyed(int flags) {
     if (flags & FLAG_DESTROYED) janet_panic("Batch is already destroyed");
 }
 
+static void collectput(void *state, const char *key, size_t keylen, const char *val, size_t vallen) {
+    JanetArray *ops = (JanetArray *) state;
+    janet_array_push(ops, janet_stringv((const uint8_t *) key, keylen));
+    janet_array_push(ops, janet_stringv((const uint8_t *) val, vallen));
+}
+
+static void collectdelete(void *state, const char *key, size_t keylen) {
+    JanetArray *ops = (JanetArray *) state;
+    janet_array_push(ops, janet_stringv((const uint8_t *) key, keylen));
+    janet_array_push(ops, janet_wrap_nil());
+}
+
+/* Replays the batch into a new one with index entries added. Values written
+ * earlier in the same batch take precedence over the stored ones. */
+static void writebatchindexed(Db *db, Batch *batch) {
+    JanetArray *ops = janet_array(16);
+    leveldb_writebatch_iterate(batch->handle, ops, collectput, collectdelete);
+    JanetTable *pending = janet_table(ops->count / 2);
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+    null_err;
+
+    for (int32_t i = 0; i < ops->count; i += 2) {
+        const char *key = (const char *) janet_unwrap_string(ops->data[i]);
+        size_t keylen = janet_string_length(janet_unwrap_string(ops->data[i]));
+        Janet prev = janet_table_get(pending, ops->data[i]);
+        Janet val = ops->data[i + 1];
+        const char *old = NULL;
+        char *stored = NULL;
+        size_t oldlen = 0;
+
+        if (janet_checktype(prev, JANET_STRING)) {
+            old = (const char *) janet_unwrap_string(prev);
+            oldlen = janet_string_length(janet_unwrap_string(prev));
+        } else if (janet_checktype(prev, JANET_NIL)) {
+            stored = leveldb_get(db->handle, db->readoptions, key, keylen, &oldlen, &err);
+            paniconbatcherr(err, wb);
+            old = stored;
+        }
+
+        if (janet_checktype(val, JANET_NIL)) {
+            batchindexes(db, wb, key, keylen, old, oldlen, NULL, 0);
+            leveldb_writebatch_delete(wb, key, keylen);
+            janet_table_put(pending, ops->data[i], janet_wrap_false());
+        } else {
+            const char *newval = (const char *) janet_unwrap_string(val);
+            size_t newlen = janet_string_length(janet_unwrap_string(val));
+            batchindexes(db, wb, key, keylen, old, oldlen, newval, newlen);
+            leveldb_writebatch_put(wb, key, keylen, newval, newlen);
+            janet_table_put(pending, ops->data[i], val);
+        }
+        leveldb_free(stored);
+    }
+
+    leveldb_write(db->handle, db->writeoptions, wb, &err);
+    leveldb_writebatch_destroy(wb);
+    paniconerr(err);
+}
+
 static Janet cfun_batch_write(int32_t argc, Janet *argv) {
     janet_fixarity(argc, 2);
     Db *db = janet_getabstract(argv, 1, &AT_db);
     paniconclosed(db->flags);
     Batch *batch = janet_getabstract(argv, 0, &AT_batch);
     paniconbdestroyed(batch->flags);
+    if (db->indexcount > 0) {
+        writebatchindexed(db, batch);
+        return janet_wrap_abstract(batch);
+    }
     null_err;
     leveldb_write(db->handle, db->writeoptions, batch->handle, &err);
     paniconerr(err);
@@ -545,6 +761,228 @@ static Janet cfun_iterator_destroy(int32_t argc, Janet *argv) {
     return janet_wrap_nil();
 }
 
+static Index *findindex(Db *db, const uint8_t *name) {
+    JanetBuffer *prefix = janet_buffer(16);
+    pushindexprefix(prefix, name);
+    for (int32_t i = 0; i < db->indexcount; i++) {
+        Index *index = &db->indexes[i];
+        if (index->prefixlen == (size_t) prefix->count &&
+                memcmp(index->prefix, prefix->data, prefix->count) == 0)
+            return index;
+    }
+    return NULL;
+}
+
+static Index *getindex(Db *db, const uint8_t *name) {
+    Index *index = findindex(db, name);
+    if (index == NULL) janet_panic("Index does not exist");
+    return index;
+}
+
+static int hasindexprefix(Index *index, const char *key, size_t keylen) {
+    return keylen >= index->prefixlen && memcmp(key, index->prefix, index->prefixlen) == 0;
+}
+
+/* Rebuilds the index from all records in one write. Its old entries are
+ * dropped, as writes made while it was not defined could leave them stale. */
+static char *fillindex(Db *db, Index *index) {
+    leveldb_readoptions_t *readoptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_fill_cache(readoptions, 0);
+    leveldb_iterator_t *it = leveldb_create_iterator(db->handle, readoptions);
+    leveldb_writebatch_t *wb = leveldb_writebatch_create();
+    JanetBuffer *entry = janet_buffer(64);
+    null_err;
+
+    /* Deletes go to the batch before puts, so the puts win for entries
+     * which are still valid. */
+    for (leveldb_iter_seek(it, (const char *) index->prefix, index->prefixlen);
+            leveldb_iter_valid(it);
+            leveldb_iter_next(it)) {
+        size_t keylen;
+        const char *key = leveldb_iter_key(it, &keylen);
+        if (!hasindexprefix(index, key, keylen)) break;
+        leveldb_writebatch_delete(wb, key, keylen);
+    }
+
+    for (leveldb_iter_seek_to_first(it); leveldb_iter_valid(it); leveldb_iter_next(it)) {
+        size_t keylen, vallen;
+        const char *key = leveldb_iter_key(it, &keylen);
+        if (isindexentry(key, keylen)) break;
+        const char *val = leveldb_iter_value(it, &vallen);
+        if (indexkey(entry, index, key, keylen, val, vallen))
+            leveldb_writebatch_put(wb, (const char *) entry->data, entry->count, "", 0);
+    }
+    leveldb_iter_get_error(it, &err);
+    leveldb_iter_destroy(it);
+    leveldb_readoptions_destroy(readoptions);
+
+    if (err == NULL) leveldb_write(db->handle, db->writeoptions, wb, &err);
+    leveldb_writebatch_destroy(wb);
+    return err;
+}
+
+static size_t getoffset(const Janet *argv, int32_t n) {
+    int32_t offset = janet_getinteger(argv, n);
+    if (offset < 0) janet_panic("Offset must not be negative");
+    return (size_t) offset;
+}
+
+static size_t getfield(const Janet *argv, int32_t n) {
+    int32_t field = janet_getinteger(argv, n);
+    if (field < 0) janet_panic("Field number must not be negative");
+    return (size_t) field;
+}
+
+static Janet cfun_index_create(int32_t argc, Janet *argv) {
+    janet_arity(argc, 4, 5);
+    Db *db = janet_getabstract(argv, 0, &AT_db);
+    paniconclosed(db->flags);
+    const uint8_t *name = janet_getstring(argv, 1);
+    if (findindex(db, name) != NULL) janet_panic("Index already exists");
+    const uint8_t *kind = janet_getkeyword(argv, 2);
+    Index index;
+    index.start = 0;
+    index.end = 0;
+    index.field = 0;
+    index.delim = 0;
+    if (strcmp((const char *) kind, "range") == 0) {
+        janet_fixarity(argc, 5);
+        index.kind = INDEX_RANGE;
+        index.start = getoffset(argv, 3);
+        index.end = getoffset(argv, 4);
+        if (index.end < index.start) janet_panic("Range end is before its start");
+    } else if (strcmp((const char *) kind, "field") == 0) {
+        janet_fixarity(argc, 5);
+        const uint8_t *delim = janet_getstring(argv, 3);
+        if (janet_string_length(delim) != 1) janet_panic("Delimiter must be one byte long");
+        index.kind = INDEX_FIELD;
+        index.delim = delim[0];
+        index.field = getfield(argv, 4);
+    } else if (strcmp((const char *) kind, "offset") == 0) {
+        janet_fixarity(argc, 4);
+        index.kind = INDEX_OFFSET;
+        index.start = getoffset(argv, 3);
+    } else {
+        janet_panic("Unrecognized index kind");
+    }
+
+    JanetBuffer *prefix = janet_buffer(16);
+    pushindexprefix(prefix, name);
+    index.prefixlen = prefix->count;
+    index.prefix = malloc(prefix->count);
+    if (index.prefix == NULL) {
+        JANET_OUT_OF_MEMORY;
+    }
+    memcpy(index.prefix, prefix->data, prefix->count);
+
+    char *err = fillindex(db, &index);
+    if (err != NULL) free(index.prefix);
+    paniconerr(err);
+
+    Index *indexes = realloc(db->indexes, (db->indexcount + 1) * sizeof(Index));
+    if (indexes == NULL) {
+        free(index.prefix);
+        JANET_OUT_OF_MEMORY;
+    }
+    db->indexes = indexes;
+    db->indexes[db->indexcount++] = index;
+
+    return janet_wrap_nil();
+}
+
+static int comparekeys(const uint8_t *key, size_t keylen, JanetBuffer *other) {
+    size_t otherlen = other->count;
+    int res = memcmp(key, other->data, keylen < otherlen ? keylen : otherlen);
+    if (res != 0) return res;
+    return (keylen > otherlen) - (keylen < otherlen);
+}
+
+/* Walks index entries from seek while they share the prefix and are
+ * before end, returning [key value] tuples of the primary records. Entries
+ * whose record no longer has the indexed value are skipped. */
+static Janet resolveindex(Db *db, Index *index, JanetBuffer *seek, JanetBuffer *prefix, JanetBuffer *end) {
+    const leveldb_snapshot_t *sn = leveldb_create_snapshot(db->handle);
+    leveldb_readoptions_t *readoptions = leveldb_readoptions_create();
+    leveldb_readoptions_set_snapshot(readoptions, sn);
+    leveldb_iterator_t *it = leveldb_create_iterator(db->handle, readoptions);
+    JanetArray *res = janet_array(0);
+    JanetBuffer *current = janet_buffer(64);
+    null_err;
+
+    for (leveldb_iter_seek(it, (const char *) seek->data, seek->count);
+            leveldb_iter_valid(it);
+            leveldb_iter_next(it)) {
+        size_t keylen;
+        const uint8_t *key = (const uint8_t *) leveldb_iter_key(it, &keylen);
+        if (keylen < (size_t) prefix->count || memcmp(key, prefix->data, prefix->count) != 0) break;
+        if (end != NULL && comparekeys(key, keylen, end) >= 0) break;
+
+        size_t pkstart = encodedend(key, keylen, index->prefixlen);
+        size_t pklen = keylen - pkstart;
+        size_t vallen;
+        char *val = leveldb_get(db->handle, readoptions, (const char *) key + pkstart, pklen, &vallen, &err);
+        if (err != NULL) break;
+        if (val == NULL) continue;
+        if (indexkey(current, index, (const char *) key + pkstart, pklen, val, vallen) &&
+                (size_t) current->count == keylen &&
+                memcmp(current->data, key, keylen) == 0) {
+            Janet entry[2];
+            entry[0] = janet_stringv(key + pkstart, pklen);
+            entry[1] = janet_stringv((const uint8_t *) val, vallen);
+            janet_array_push(res, janet_wrap_tuple(janet_tuple_n(entry, 2)));
+        }
+        leveldb_free(val);
+    }
+    if (err == NULL) leveldb_iter_get_error(it, &err);
+
+    leveldb_iter_destroy(it);
+    leveldb_readoptions_destroy(readoptions);
+    leveldb_release_snapshot(db->handle, sn);
+    paniconerr(err);
+
+    return janet_wrap_array(res);
+}
+
+static Janet cfun_index_get(int32_t argc, Janet *argv) {
+    janet_fixarity(argc, 3);
+    Db *db = janet_getabstract(argv, 0, &AT_db);
+    paniconclosed(db->flags);
+    Index *index = getindex(db, janet_getstring(argv, 1));
+    const uint8_t *val = janet_getstring(argv, 2);
+
+    JanetBuffer *prefix = janet_buffer(index->prefixlen + 16);
+    janet_buffer_push_bytes(prefix, index->prefix, index->prefixlen);
+    pushencoded(prefix, val, janet_string_length(val));
+
+    return resolveindex(db, index, prefix, prefix, NULL);
+}
+
+static Janet cfun_index_scan(int32_t argc, Janet *argv) {
+    janet_arity(argc, 2, 4);
+    Db *db = janet_getabstract(argv, 0, &AT_db);
+    paniconclosed(db->flags);
+    Index *index = getindex(db, janet_getstring(argv, 1));
+
+    JanetBuffer *prefix = janet_buffer(index->prefixlen);
+    janet_buffer_push_bytes(prefix, index->prefix, index->prefixlen);
+    JanetBuffer *seek = prefix;
+    JanetBuffer *end = NULL;
+    if (argc > 2 && !janet_checktype(argv[2], JANET_NIL)) {
+        const uint8_t *from = janet_getstring(argv, 2);
+        seek = janet_buffer(index->prefixlen + 16);
+        janet_buffer_push_bytes(seek, index->prefix, index->prefixlen);
+        pushencoded(seek, from, janet_string_length(from));
+    }
+    if (argc > 3 && !janet_checktype(argv[3], JANET_NIL)) {
+        const uint8_t *to = janet_getstring(argv, 3);
+        end = janet_buffer(index->prefixlen + 16);
+        janet_buffer_push_bytes(end, index->prefix, index->prefixlen);
+        pushencoded(end, to, janet_string_length(to));
+    }
+
+    return resolveindex(db, index, seek, prefix, end);
+}
+
 static JanetMethod db_methods[] = {
     {"close", cfun_close},
     {"get", cfun_record_get},
@@ -552,6 +990,9 @@ static JanetMethod db_methods[] = {
     {"delete", cfun_record_delete},
     {"iterator", cfun_iterator_create},
     {"snapshot", cfun_snapshot_create},
+    {"index", cfun_index_create},
+    {"index-get", cfun_index_get},
+    {"index-scan", cfun_index_scan},
     {NULL, NULL}
 };
 
@@ -639,6 +1080,13 @@ static const JanetReg iterator_cfuns[] = {
     {NULL, NULL, NULL}
 };
 
+static const JanetReg index_cfuns[] = {
+    {"index/create", cfun_index_create, "(tahani/index/create db name kind & args)\n\nDefines index with the name on the db. Kind :range with start and end indexes the bytes between them, kind :field with delimiter and n indexes the nth delimited field and kind :offset with start indexes the bytes from start to the end of the value. The index is filled from the records already in the db. Puts, deletes and batch writes through the db keep the index entries in the same write."},
+    {"index/get", cfun_index_get, "(tahani/index/get db name value)\n\nReturns array of [key value] tuples for records which have value in the index with the name."},
+    {"index/scan", cfun_index_scan, "(tahani/index/scan db name &opt start end)\n\nReturns array of [key value] tuples for records with indexed value from start inclusive to end exclusive, ordered by the indexed value. Nil start or end is unbounded."},
+    {NULL, NULL, NULL}
+};
+
 static const JanetReg manage_cfuns[] = {
     {"manage/destroy", cfun_destroy, "(tahani/destroy db)\n\nDestroy the level DB with the name. A name must be a string."},
     {"manage/repair", cfun_repair, "(tahani/repair db)\n\nDestroy the level DB with the name. A name must be a string."},
@@ -651,5 +1099,6 @@ JANET_MODULE_ENTRY(JanetTable *env) {
     janet_cfuns(env, "tahani", batch_cfuns);
     janet_cfuns(env, "tahani", snapshot_cfuns);
     janet_cfuns(env, "tahani", iterator_cfuns);
+    janet_cfuns(env, "tahani", index_cfuns);
     janet_cfuns(env, "tahani", manage_cfuns);
 }